@@ -1,6 +1,8 @@
 #include "concurrence_queue.hpp"
 #include "process.hpp"
-#include <array>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
 #include <filesystem>
 #include <fstream>
 #include <iostream>
@@ -21,6 +23,55 @@ int processed_chunk_count = 0;
 std::mutex write_lock;
 std::string input_path_prefix;
 
+// Automatic block size policy
+constexpr std::size_t SINGLE_BLOCK_FILE_SIZE = 1024 * 1024;   // Files up to this size are stored as one block
+constexpr std::size_t AUTO_MAX_BLOCK_SIZE = 4 * 1024 * 1024;  // Block size for the largest files
+
+// Adaptive level parameters
+// Measured in bytes, block sizes vary from a few bytes to several MB
+#define LEVEL_ADJUST_INTERVAL (4 * 1024 * 1024)  // Bytes compressed between two level decisions
+#define QUEUE_LOW_WATERMARK (128 * 1024)         // Below this many queued bytes the consumers are waiting on the producer
+#define QUEUE_HIGH_WATERMARK (16 * 1024 * 1024)  // Above this many queued bytes the consumers are the bottleneck
+#define WRITER_STALL_RATIO 0.1    // Fraction of the window consumers may spend writing before writing counts as the bottleneck
+
+// MPI is initialised without thread support, so worker threads time themselves with steady_clock
+using Clock = std::chrono::steady_clock;
+
+CompressionOptions compression_options;
+std::atomic<int> current_level{Z_DEFAULT_COMPRESSION};
+
+// Producer statistics, shared with the consumers
+std::atomic<long long> queued_bytes{0};
+std::atomic<long long> producer_bytes_read{0};
+std::atomic<long long> producer_read_nanos{0};
+
+// Consumer statistics of the current window, guarded by write_lock
+Clock::time_point window_start_time;
+long long window_bytes = 0;
+double window_stall_time = 0;
+long long window_read_bytes = 0;
+long long window_read_nanos = 0;
+long long level_sum = 0;
+std::size_t max_block_written = 0;
+
+// Block size for a file of the given size. Small files become a single block, large files use bigger
+// blocks to cut per-record overhead and improve the ratio.
+std::size_t choose_block_size(std::uintmax_t file_size) {
+    if (compression_options.block_size > 0) {
+        return compression_options.block_size;
+    }
+    if (file_size <= SINGLE_BLOCK_FILE_SIZE) {
+        return std::max<std::size_t>(static_cast<std::size_t>(file_size), 1);
+    }
+    if (file_size <= 64 * 1024 * 1024) {
+        return 256 * 1024;
+    }
+    if (file_size <= 1024 * 1024 * 1024) {
+        return 1024 * 1024;
+    }
+    return AUTO_MAX_BLOCK_SIZE;
+}
+
 void producer(const std::string &input_dir, const std::string &file_record, int world_rank) {
     std::ifstream record_file(file_record);
     if (!record_file.is_open()) {
@@ -47,20 +98,34 @@ void producer(const std::string &input_dir, const std::string &file_record, int
                 continue;
             }
 
+            std::uintmax_t remaining = std::filesystem::file_size(full_path);
+            std::size_t block_size = choose_block_size(remaining);
             int sequence_id = 0;// sequence_id is used to identify the order of the chunk in the file
 
-            while (!source.eof()) {
+            bool is_last_chunk = false;
+            while (!is_last_chunk) {
+                std::size_t read_size = static_cast<std::size_t>(std::min<std::uintmax_t>(block_size, remaining));
+
                 Chunk chunk;
                 chunk.sequence_id = sequence_id++;
                 chunk.relative_path = file_path;
-                source.read(reinterpret_cast<char *>(chunk.data.data()), CHUNK_SIZE);
+                chunk.data.reset(new unsigned char[read_size]);
+                auto read_start = Clock::now();
+                source.read(reinterpret_cast<char *>(chunk.data.get()), static_cast<std::streamsize>(read_size));
                 chunk.size = source.gcount();
-                chunk.is_last_chunk = source.eof();
+                producer_read_nanos += std::chrono::duration_cast<std::chrono::nanoseconds>(Clock::now() - read_start).count();
+                producer_bytes_read += static_cast<long long>(chunk.size);
+                remaining -= chunk.size;
+
+                // A short read means the file shrank since it was listed, stop at what we have
+                is_last_chunk = remaining == 0 || chunk.size < read_size;
+                chunk.is_last_chunk = is_last_chunk;
                 chunk.is_last_file = (next_file_number >= max_record_line_num) && chunk.is_last_chunk;
 
                 // std::cout << "Rank: " << world_rank << " - Pushing chunk: " << chunk.sequence_id << " - " << chunk.relative_path << "-" << chunk.size << std::endl;
 
-                queue.push(chunk);
+                queued_bytes += static_cast<long long>(chunk.size);
+                queue.push(std::move(chunk));
             }
         }
 
@@ -70,7 +135,8 @@ void producer(const std::string &input_dir, const std::string &file_record, int
     std::cout << "Rank: " << world_rank << " - Total processed file: " << file_number << std::endl;
 }
 
-void data_writer(const Chunk *chunk, long compressed_size, const unsigned char *compressed_data, std::ofstream &dest) {
+void data_writer(const Chunk *chunk, long compressed_size, const unsigned char *compressed_data, const std::string &md5_value,
+                 std::ofstream &dest) {
     // Calculate the total size of the CompressedChunk
     int path_length = static_cast<int>(chunk->relative_path.size());
     int total_size = sizeof(path_length) + path_length +
@@ -93,17 +159,73 @@ void data_writer(const Chunk *chunk, long compressed_size, const unsigned char *
     dest.write(reinterpret_cast<const char *>(compressed_data), compressed_size);
 
     if (chunk->is_last_chunk) {
-        std::string md5_value;
-        std::filesystem::path full_path = std::filesystem::path(input_path_prefix) / chunk->relative_path;
-        md5_value = md5_of_file(full_path);
-
         std::cout << "md5 value size: " << md5_value.size() << std::endl;
 
         dest.write(md5_value.c_str(), md5_value.size());
     }
 }
 
+// Pick the deflate level for the next window from queue depth, producer read rate and writer stall time.
+// Must be called with write_lock held.
+void adjust_level() {
+    if (!compression_options.auto_level || window_bytes < LEVEL_ADJUST_INTERVAL) {
+        return;
+    }
+
+    Clock::time_point now = Clock::now();
+    double elapsed = std::chrono::duration<double>(now - window_start_time).count();
+    if (elapsed <= 0) {
+        return;
+    }
+
+    long long read_bytes = producer_bytes_read - window_read_bytes;
+    long long read_nanos = producer_read_nanos - window_read_nanos;
+
+    double throughput = window_bytes / elapsed / (1024 * 1024);
+    double read_rate = read_nanos > 0 ? read_bytes / (read_nanos / 1e9) / (1024 * 1024) : 0;
+    double stall_ratio = window_stall_time / elapsed;
+    long long depth = queued_bytes;
+
+    int level = current_level;
+    if (compression_options.target_throughput > 0) {
+        // The target is for the whole job, every rank that has files to compress takes an equal share
+        int active_ranks = std::max(1, std::min(mpi_proc_size, max_record_line_num));
+        double rank_target = compression_options.target_throughput / active_ranks;
+
+        if (read_nanos > 0 && read_rate < rank_target) {
+            // Reading cannot keep up with the target anyway, spend idle CPU on ratio as long as
+            // compression does not fall behind reading
+            if (depth > QUEUE_HIGH_WATERMARK) {
+                --level;
+            } else if (depth < QUEUE_HIGH_WATERMARK) {
+                ++level;
+            }
+        } else if (throughput < rank_target) {
+            --level;
+        } else if (throughput > rank_target * 1.2 && depth < QUEUE_LOW_WATERMARK) {
+            ++level;
+        }
+    } else {
+        if (depth > QUEUE_HIGH_WATERMARK) {
+            // Chunks are piling up, compression is the bottleneck
+            --level;
+        } else if (depth < QUEUE_LOW_WATERMARK || stall_ratio > WRITER_STALL_RATIO) {
+            // Consumers are waiting on reading or writing, the CPU has room for a better ratio
+            ++level;
+        }
+    }
+    current_level = std::clamp(level, compression_options.min_level, compression_options.max_level);
+
+    window_start_time = now;
+    window_bytes = 0;
+    window_stall_time = 0;
+    window_read_bytes += read_bytes;
+    window_read_nanos += read_nanos;
+}
+
 void consumer(std::ofstream &dest) {
+    std::vector<unsigned char> out;// Reused across chunks, only grows
+
     while (!consumer_task_finished) {
         std::shared_ptr<Chunk> chunkPtr = queue.tryPop();
         if (!chunkPtr) {
@@ -114,30 +236,48 @@ void consumer(std::ofstream &dest) {
         }
 
         Chunk &chunk = *chunkPtr;
+        queued_bytes -= static_cast<long long>(chunk.size);
 
         // Compress the chunk  -> zlib
         z_stream strm;
         strm.zalloc = Z_NULL;
         strm.zfree = Z_NULL;
         strm.opaque = Z_NULL;
-        deflateInit(&strm, Z_DEFAULT_COMPRESSION);
+        int level = current_level;
+        deflateInit(&strm, level);
 
+        // Size the output for the worst case so incompressible data is never truncated
+        out.resize(deflateBound(&strm, chunk.size));
         strm.avail_in = chunk.size;
-        strm.next_in = reinterpret_cast<Bytef*>(chunk.data.data());
-        unsigned char out[CHUNK_SIZE];
-        strm.avail_out = CHUNK_SIZE;
-        strm.next_out = out;
+        strm.next_in = reinterpret_cast<Bytef*>(chunk.data.get());
+        strm.avail_out = out.size();
+        strm.next_out = out.data();
 
         deflate(&strm, Z_FINISH);
-        long compressed_size = CHUNK_SIZE - strm.avail_out;
+        long compressed_size = out.size() - strm.avail_out;
 
         deflateEnd(&strm);
 
+        // The MD5 of a finished file is computed outside the lock, the level has no effect on its cost
+        std::string md5_value;
+        if (chunk.is_last_chunk) {
+            md5_value = md5_of_file(std::filesystem::path(input_path_prefix) / chunk.relative_path);
+        }
+
         // Make sure only one thread is writing to the file at a time
+        auto write_start = Clock::now();
         {
             std::lock_guard<std::mutex> lock(write_lock);
-            data_writer(&chunk, compressed_size, out, dest);
+            data_writer(&chunk, compressed_size, out.data(), md5_value, dest);
             ++processed_chunk_count;
+            max_block_written = std::max(max_block_written, chunk.size);
+
+            // Waiting for the lock and writing is time not spent compressing
+            window_stall_time += std::chrono::duration<double>(Clock::now() - write_start).count();
+
+            window_bytes += static_cast<long long>(chunk.size);
+            level_sum += level;
+            adjust_level();
         }
 
         // If this is the last chunk of the last file, end the consumers
@@ -158,8 +298,17 @@ std::string generate_output_filename(const std::string& output_dir, int world_ra
     return filename.string();
 }
 
-void do_compression(const std::string &input_dir, const std::string &output_dir, const std::string &file_record, int world_rank) {
+void do_compression(const std::string &input_dir, const std::string &output_dir, const std::string &file_record, int world_rank,
+                    const CompressionOptions &options, const NodeTopology &topology) {
+    // The pipeline always runs one producer and NUM_CONSUMERS consumers. The consumers spin while the queue is empty,
+    // so only pin when the rank has a CPU for each thread, otherwise let the scheduler spread them.
     omp_set_num_threads(NUM_CONSUMERS + 1);
+    bool pin_threads = topology.cpus.size() >= NUM_CONSUMERS + 1;
+
+    compression_options = options;
+    // Auto level starts from zlib's default level 6
+    current_level = options.auto_level ? std::clamp(6, options.min_level, options.max_level) : Z_DEFAULT_COMPRESSION;
+    window_start_time = Clock::now();
 
     MPI_Comm_size(MPI_COMM_WORLD, &mpi_proc_size);
     MPI_Comm_rank(MPI_COMM_WORLD, &mpi_proc_rank);
@@ -170,12 +319,21 @@ void do_compression(const std::string &input_dir, const std::string &output_dir,
     std::ofstream dest(output_filename, std::ios::binary);
     input_path_prefix = input_dir;
 
+    ArchiveHeader header{};
+    std::copy(std::begin(ARCHIVE_MAGIC), std::end(ARCHIVE_MAGIC), header.magic);
+    dest.write(reinterpret_cast<const char *>(&header), sizeof(header));
+
     std::cout << "Max record line num: " << max_record_line_num << std::endl;
 
     #pragma omp parallel sections
     {
         #pragma omp critical
         {
+            // Bind before reading so chunk buffers are first touched on the rank's NUMA node. Producer and
+            // consumers share those buffers, so they all bind to the same node.
+            if (pin_threads) {
+                bind_thread_to_topology(topology, 0);
+            }
             producer(input_dir, file_record, world_rank);
         }
 
@@ -184,11 +342,24 @@ void do_compression(const std::string &input_dir, const std::string &output_dir,
             for (int i = 0; i < NUM_CONSUMERS; ++i) {
                 #pragma omp task
                 {
+                    if (pin_threads) {
+                        bind_thread_to_topology(topology, 0);
+                    }
                     consumer(dest);
                 }
             }
         }
     }
 
+    // Now that every block is written, record the largest one so readers size their buffers to fit
+    header.max_block_size = static_cast<std::uint32_t>(max_block_written);
+    dest.seekp(0);
+    dest.write(reinterpret_cast<const char *>(&header), sizeof(header));
     dest.close();
+
+    if (options.auto_level && processed_chunk_count > 0) {
+        std::cout << "Rank: " << world_rank << " - Average compression level: "
+                  << static_cast<double>(level_sum) / processed_chunk_count
+                  << ", final level: " << current_level << std::endl;
+    }
 }
\ No newline at end of file
@@ -39,7 +39,7 @@ public:
     std::shared_ptr<DATATYPE> tryPop() {
         std::lock_guard<std::mutex> lg(m_mutex);
         if (m_data.empty()) return {};
-        auto res = std::make_shared<DATATYPE>(m_data.front());
+        auto res = std::make_shared<DATATYPE>(std::move(m_data.front()));
         m_data.pop();
         return res;
     }
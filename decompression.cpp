@@ -1,168 +1,257 @@
 #include "process.hpp"
+#include <algorithm>
+#include <cstddef>
+#include <cstring>
+#include <fcntl.h>
 #include <filesystem>
 #include <fstream>
 #include <iostream>
-#include <map>
-#include <queue>
 #include <string>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
 #include <vector>
 #include <zlib.h>
 
-void decompress_chunk(CompressedChunk &chunk, std::ostream &dest) {
-    if (chunk.data.empty()) {
-        return;
+// Read-only mapping of a whole archive
+struct MappedArchive {
+    const unsigned char *data = nullptr;
+    std::size_t size = 0;
+
+    MappedArchive() = default;
+    MappedArchive(const MappedArchive &) = delete;
+    MappedArchive &operator=(const MappedArchive &) = delete;
+
+    ~MappedArchive() {
+        if (data != nullptr) {
+            munmap(const_cast<unsigned char *>(data), size);
+        }
     }
 
-    z_stream strm;
-    strm.zalloc = Z_NULL;
-    strm.zfree = Z_NULL;
-    strm.opaque = Z_NULL;
-    if (inflateInit(&strm) != Z_OK) {
-        return;
+    bool open(const std::string &filename) {
+        int fd = ::open(filename.c_str(), O_RDONLY);
+        if (fd == -1) {
+            return false;
+        }
+
+        struct stat file_stat{};
+        if (fstat(fd, &file_stat) != 0) {
+            close(fd);
+            return false;
+        }
+
+        size = static_cast<std::size_t>(file_stat.st_size);
+        if (size > 0) {
+            void *mapping = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+            if (mapping == MAP_FAILED) {
+                close(fd);
+                return false;
+            }
+            data = static_cast<const unsigned char *>(mapping);
+            // Records are scanned and inflated front to back
+            madvise(mapping, size, MADV_SEQUENTIAL);
+        }
+
+        close(fd);
+        return true;
     }
+};
+
+// Fields inside records are not aligned, so read them byte-wise
+template<typename T>
+T read_field(const unsigned char *ptr) {
+    T value;
+    std::memcpy(&value, ptr, sizeof(T));
+    return value;
+}
 
-    strm.avail_in = chunk.data.size();
-    strm.next_in = reinterpret_cast<Bytef*>(chunk.data.data());
+// Scan every record header in one pass and collect where the chunks are. Returns false if the archive is truncated.
+bool scan_records(const MappedArchive &archive, std::size_t offset, std::vector<CompressedChunk> &chunks) {
+    constexpr std::size_t fixed_size = sizeof(int) + sizeof(int) + sizeof(int) + sizeof(bool);
 
-    unsigned char out[CHUNK_SIZE];
-    do {
-        strm.avail_out = sizeof(out);
-        strm.next_out = out;
-        inflate(&strm, Z_NO_FLUSH);
+    while (offset < archive.size) {
+        if (archive.size - offset < sizeof(int) + sizeof(int)) {
+            return false;
+        }
+        int total_size = read_field<int>(archive.data + offset);
+        int path_length = read_field<int>(archive.data + offset + sizeof(int));
+        if (total_size < 0 || path_length < 0 ||
+            static_cast<std::size_t>(total_size) + sizeof(int) < fixed_size + path_length ||
+            archive.size - offset - sizeof(int) < static_cast<std::size_t>(total_size)) {
+            return false;
+        }
 
-        dest.write(reinterpret_cast<char *>(out), sizeof(out) - strm.avail_out);
-    } while (strm.avail_out == 0);
+        const unsigned char *path = archive.data + offset + sizeof(int) + sizeof(int);
+        const unsigned char *flags = path + path_length;
 
-    inflateEnd(&strm);
+        CompressedChunk chunk{};
+        chunk.relative_path = std::string_view(reinterpret_cast<const char *>(path), path_length);
+        chunk.sequence_id = read_field<int>(flags);
+        chunk.is_last_chunk = read_field<bool>(flags + sizeof(int));
+        chunk.data_offset = offset + fixed_size + path_length;
+        chunk.data_size = total_size + sizeof(int) - fixed_size - path_length;
+        offset = chunk.data_offset + chunk.data_size;
+
+        if (chunk.is_last_chunk) {
+            if (archive.size - offset < MD5_DATA_SIZE) {
+                return false;
+            }
+            chunk.md5_offset = offset;
+            offset += MD5_DATA_SIZE;
+        }
+
+        chunks.push_back(chunk);
+    }
+
+    return true;
 }
 
-struct CompareChunks {
-    bool operator()(const CompressedChunk &a, const CompressedChunk &b) {
-        return a.sequence_id > b.sequence_id;
+// Inflate one chunk straight from the mapping. strm is reset rather than re-initialised for every chunk.
+// The output is hashed as it is written, so the file never has to be read back for verification.
+bool decompress_chunk(z_stream &strm, const unsigned char *data, std::size_t size, std::ostream &dest,
+                      std::vector<unsigned char> &out, MD5_CTX &md5) {
+    if (size == 0) {
+        return true;
     }
-};
+
+    inflateReset(&strm);
+    strm.avail_in = static_cast<uInt>(size);
+    strm.next_in = const_cast<Bytef *>(data);
+
+    int ret;
+    do {
+        strm.avail_out = out.size();
+        strm.next_out = out.data();
+        ret = inflate(&strm, Z_NO_FLUSH);
+        if (ret != Z_OK && ret != Z_STREAM_END) {
+            return false;
+        }
+
+        dest.write(reinterpret_cast<char *>(out.data()), out.size() - strm.avail_out);
+        MD5_Update(&md5, out.data(), out.size() - strm.avail_out);
+    } while (ret != Z_STREAM_END && strm.avail_out == 0);
+
+    return ret == Z_STREAM_END;
+}
 
 void decompress_zwz(const std::string &filename, const std::string &output_dir) {
-    std::ifstream source(filename, std::ios::binary);
-    if (!source.is_open()) {
+    MappedArchive archive;
+    if (!archive.open(filename)) {
         std::cerr << "Error opening file: " << filename << std::endl;
         return;
     }
 
-    std::map<std::string, std::priority_queue<CompressedChunk, std::vector<CompressedChunk>, CompareChunks>> pending_chunks;
-    std::map<std::string, int> expected_sequence_id;
-    std::map<std::string, std::ofstream> output_files;
-    std::map<std::string, std::string> file_md5s;
-
-    auto remove_file_info = [&](const std::string &relative_path) {
-        output_files[relative_path].close();
-        output_files.erase(relative_path);
-        expected_sequence_id.erase(relative_path);
-        pending_chunks.erase(relative_path);
-        file_md5s.erase(relative_path);
-    };
+    // Archives written before the header was introduced start directly with a record
+    std::size_t offset = 0;
+    std::size_t max_block_size = LEGACY_CHUNK_SIZE;
+    if (archive.size >= sizeof(ArchiveHeader) && std::equal(std::begin(ARCHIVE_MAGIC), std::end(ARCHIVE_MAGIC), archive.data)) {
+        // Inflate loops over the output buffer, so capping it never loses data
+        max_block_size = std::min<std::size_t>(read_field<std::uint32_t>(archive.data + offsetof(ArchiveHeader, max_block_size)),
+                                               MAX_CHUNK_SIZE);
+        offset = sizeof(ArchiveHeader);
+    }
+
+    std::vector<CompressedChunk> chunks;
+    if (!scan_records(archive, offset, chunks)) {
+        std::cerr << "Warning: truncated archive, ignoring the incomplete record at the end of: " << filename << std::endl;
+    }
 
-    while (!source.eof()) {
-        int total_size;
-        source.read(reinterpret_cast<char *>(&total_size), sizeof(total_size));
-        if (source.eof()) break;    // End of file
+    // Bring the chunks of each file together in sequence order, so no chunk has to wait in memory
+    std::stable_sort(chunks.begin(), chunks.end(), [](const CompressedChunk &a, const CompressedChunk &b) {
+        return a.relative_path != b.relative_path ? a.relative_path < b.relative_path : a.sequence_id < b.sequence_id;
+    });
 
-        int path_length;
-        source.read(reinterpret_cast<char *>(&path_length), sizeof(path_length));
+    // Visit files in the order they appear in the archive, so the mapping is read front to back
+    struct FileChunks {
+        std::size_t first_offset;
+        std::vector<CompressedChunk>::const_iterator begin, end;
+    };
+    std::vector<FileChunks> files;
+    for (auto begin = chunks.cbegin(); begin != chunks.cend();) {
+        auto end = std::find_if(begin, chunks.cend(), [&](const CompressedChunk &chunk) {
+            return chunk.relative_path != begin->relative_path;
+        });
+        auto first = std::min_element(begin, end, [](const CompressedChunk &a, const CompressedChunk &b) {
+            return a.data_offset < b.data_offset;
+        });
+        files.push_back({first->data_offset, begin, end});
+        begin = end;
+    }
+    std::sort(files.begin(), files.end(), [](const FileChunks &a, const FileChunks &b) {
+        return a.first_offset < b.first_offset;
+    });
 
-        std::string relative_path(path_length, '\0');
-        source.read(&relative_path[0], path_length);
+    // Output buffer for inflate, one block fits at once
+    std::vector<unsigned char> out(std::max<std::size_t>(max_block_size, 1));
 
-        int sequence_id;
-        source.read(reinterpret_cast<char *>(&sequence_id), sizeof(sequence_id));
+    z_stream strm;
+    strm.zalloc = Z_NULL;
+    strm.zfree = Z_NULL;
+    strm.opaque = Z_NULL;
+    strm.avail_in = 0;
+    strm.next_in = Z_NULL;
+    if (inflateInit(&strm) != Z_OK) {
+        std::cerr << "Error initialising inflate for: " << filename << std::endl;
+        return;
+    }
 
-        bool is_last_chunk;
-        source.read(reinterpret_cast<char *>(&is_last_chunk), sizeof(is_last_chunk));
+    for (const FileChunks &file : files) {
+        auto first = file.begin;
+        auto last = file.end;
 
-        int compressed_data_size = total_size - (sizeof(path_length) + path_length + sizeof(sequence_id) + sizeof(is_last_chunk));
-        std::vector<unsigned char> compressed_data(compressed_data_size);
-        source.read(reinterpret_cast<char *>(compressed_data.data()), compressed_data.size());
+        std::string relative_path(first->relative_path);
+        std::string file_path = output_dir + "/" + relative_path;
 
-        if (is_last_chunk) {
-            std::string stored_md5(MD5_DATA_SIZE, '\0');
-            source.read(&stored_md5[0], MD5_DATA_SIZE);
+        // Create the directories in the file path if they don't exist
+        std::filesystem::path dir = std::filesystem::path(file_path).parent_path();
+        if (!std::filesystem::exists(dir)) {
+            std::filesystem::create_directories(dir); // Create the directories
+        }
 
-            std::cout << "Read MD5: " << stored_md5 << std::endl;
-            file_md5s[relative_path] = stored_md5;
+        std::ofstream output_file(file_path, std::ios::binary);
+        if (!output_file.is_open()) {
+            std::cerr << "Error creating output file: " << file_path << std::endl;
+            continue;
         }
 
-        // Open the corresponding output file if not opened yet
-        if (output_files.find(relative_path) == output_files.end()) {
-            std::string file_path = output_dir + "/" + relative_path;
+        MD5_CTX md5;
+        MD5_Init(&md5);
 
-            // Create the directories in the file path if they don't exist
-            std::filesystem::path dir = std::filesystem::path(file_path).parent_path();
-            if (!std::filesystem::exists(dir)) {
-                std::filesystem::create_directories(dir); // Create the directories
+        int expected_sequence_id = 0;
+        const CompressedChunk *last_chunk = nullptr;
+        for (auto chunk = first; chunk != last && chunk->sequence_id == expected_sequence_id; ++chunk, ++expected_sequence_id) {
+            if (!decompress_chunk(strm, archive.data + chunk->data_offset, chunk->data_size, output_file, out, md5)) {
+                std::cerr << "Error inflating chunk " << chunk->sequence_id << " of file: " << file_path << std::endl;
+                break;
             }
-
-            output_files[relative_path].open(file_path, std::ios::binary);
-            if (!output_files[relative_path].is_open()) {
-                std::cerr << "Error creating output file: " << file_path << std::endl;
-                continue;
+            if (chunk->is_last_chunk) {
+                last_chunk = &*chunk;
+                break;
             }
-            expected_sequence_id[relative_path] = 0;
         }
+        output_file.close();
 
-        CompressedChunk chunk;
-        chunk.relative_path = relative_path;
-        chunk.sequence_id = sequence_id;
-        chunk.is_last_chunk = is_last_chunk;
-        std::copy(compressed_data.begin(), compressed_data.end(), chunk.data.begin());
-
-        // If this is the next expected chunk, process it immediately
-        if (expected_sequence_id[relative_path] == sequence_id) {
-            decompress_chunk(chunk, output_files[relative_path]);
-            expected_sequence_id[relative_path]++;
-
-            // Check if there are pending chunks that can be processed
-            while (!pending_chunks[relative_path].empty() &&
-                   pending_chunks[relative_path].top().sequence_id == expected_sequence_id[relative_path]) {
-                CompressedChunk next_chunk = pending_chunks[relative_path].top();
-                pending_chunks[relative_path].pop();
-                decompress_chunk(next_chunk, output_files[relative_path]);
-                expected_sequence_id[relative_path]++;
-            }
-
-            if (is_last_chunk && expected_sequence_id[relative_path] == sequence_id + 1 && pending_chunks[relative_path].empty()) {
-                std::string file_path = output_dir + "/" + relative_path;
-                output_files[relative_path].close();
-
-                std::string calculated_md5 = md5_of_file(file_path);
-                std::string stored_md5 = file_md5s[relative_path];
-
-                // Compare the calculated MD5 with the stored MD5
-                if (calculated_md5 != stored_md5) {
-                    std::cerr << "MD5 mismatch for file: " << file_path << std::endl;
-                    std::cout << "Expected MD5: " << stored_md5 << std::endl;
-                    std::cout << "Calculated MD5: " << calculated_md5 << std::endl;
-                } else {
-                    std::cout << "MD5 match for file: " << file_path << std::endl;
-                }
-
-                remove_file_info(relative_path);
-            }
+        if (last_chunk == nullptr) {
+            std::cerr << "Warning: missing chunks for file: " << file_path << std::endl;
         } else {
-            // Else, add the chunk to the waiting queue
-            pending_chunks[relative_path].push(chunk);
+            std::string stored_md5(reinterpret_cast<const char *>(archive.data + last_chunk->md5_offset), MD5_DATA_SIZE);
+            std::string calculated_md5 = md5_hex(md5);
+
+            // Compare the calculated MD5 with the stored MD5
+            if (calculated_md5 != stored_md5) {
+                std::cerr << "MD5 mismatch for file: " << file_path << std::endl;
+                std::cout << "Expected MD5: " << stored_md5 << std::endl;
+                std::cout << "Calculated MD5: " << calculated_md5 << std::endl;
+            } else {
+                std::cout << "MD5 match for file: " << file_path << std::endl;
+            }
         }
     }
 
-    // Deal with remaining files
-    for (auto &pair: output_files) {
-        if (!pending_chunks[pair.first].empty()) {
-            std::cerr << "Warning: pending chunks remaining for file: " << pair.first << std::endl;
-        }
-        pair.second.close();
-    }
+    inflateEnd(&strm);
 }
 
-void do_decompression(const std::string &input_dir, const std::string &output_dir) {
+void do_decompression(const std::string &input_dir, const std::string &output_dir, const NodeTopology &topology) {
     std::vector<std::string> files;
 
     for (const auto &entry : std::filesystem::directory_iterator(input_dir)) {
@@ -171,8 +260,15 @@ void do_decompression(const std::string &input_dir, const std::string &output_di
         }
     }
 
-    #pragma omp parallel for num_threads(omp_get_num_procs() * 2)
-    for (const auto & file : files) {
-        decompress_zwz(file, output_dir);
+    // One thread per CPU of this rank, so ranks sharing a node do not oversubscribe it
+    #pragma omp parallel num_threads(topology_thread_count(topology))
+    {
+        // Threads spread over the rank's NUMA nodes, each one stays on a single node
+        bind_thread_to_topology(topology, omp_get_thread_num());
+
+        #pragma omp for
+        for (const auto & file : files) {
+            decompress_zwz(file, output_dir);
+        }
     }
 }
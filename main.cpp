@@ -7,7 +7,7 @@
 #include <sys/stat.h>
 #include <vector>
 
-void compress(const std::string &folder_path, const std::string &output_path) {
+void compress(const std::string &folder_path, const std::string &output_path, const CompressionOptions &options) {
     int world_rank, world_size;
     MPI_Comm_rank(MPI_COMM_WORLD, &world_rank);
     MPI_Comm_size(MPI_COMM_WORLD, &world_size);
@@ -43,9 +43,17 @@ void compress(const std::string &folder_path, const std::string &output_path) {
 
     int file_count = count_non_empty_lines(file_record);
 
+    // Only ranks with files to compress share the node's CPUs
+    MPI_Comm active_comm;
+    MPI_Comm_split(MPI_COMM_WORLD, world_rank < file_count ? 0 : MPI_UNDEFINED, world_rank, &active_comm);
+
     // Step 3: Compress files
         if (world_rank < file_count) {
-            do_compression(folder_path, output_path, file_record, world_rank);
+            NodeTopology topology = detect_topology(active_comm);
+            MPI_Comm_free(&active_comm);
+            std::cout << "Rank: " << world_rank << " - " << describe_topology(topology) << std::endl;
+
+            do_compression(folder_path, output_path, file_record, world_rank, options, topology);
         } else {
             std::cout << "Rank: " << world_rank << " - No file to compress" << std::endl;
         }
@@ -65,7 +73,11 @@ void decompress(const std::string &source_path, const std::string &output_path)
             std::cout << "Decompression uses multiple threads to parallel decompress files.\n";
         }
 
-        do_decompression(source_path, output_path);
+        // Only this rank decompresses, so it gets every CPU it can run on
+        NodeTopology topology = detect_topology(MPI_COMM_SELF);
+        std::cout << "Rank: " << world_rank << " - " << describe_topology(topology) << std::endl;
+
+        do_decompression(source_path, output_path, topology);
     }
 }
 
@@ -75,6 +87,66 @@ void remove_trailing_slash(std::string &path) {
     }
 }
 
+// Parse a block size such as "65536", "512K" or "4M", returns 0 on invalid input
+std::size_t parse_block_size(const std::string &value) {
+    std::size_t pos = 0;
+    unsigned long long size = std::stoull(value, &pos);
+    std::string suffix = value.substr(pos);
+    if (suffix == "K" || suffix == "k") {
+        size *= 1024;
+    } else if (suffix == "M" || suffix == "m") {
+        size *= 1024 * 1024;
+    } else if (!suffix.empty()) {
+        return 0;
+    }
+    return static_cast<std::size_t>(size);
+}
+
+// Parse the optional flags after the positional arguments, returns false on invalid input
+bool parse_compression_options(int argc, char *argv[], CompressionOptions &options) {
+    for (int i = 4; i < argc; ++i) {
+        std::string arg = argv[i];
+        try {
+            if (arg == "--auto-level") {
+                options.auto_level = true;
+            } else if (arg == "--target-throughput" && i + 1 < argc) {
+                options.target_throughput = std::stod(argv[++i]);
+                options.auto_level = true;
+            } else if (arg == "--min-level" && i + 1 < argc) {
+                options.min_level = std::stoi(argv[++i]);
+                options.auto_level = true;
+            } else if (arg == "--max-level" && i + 1 < argc) {
+                options.max_level = std::stoi(argv[++i]);
+                options.auto_level = true;
+            } else if (arg == "--block-size" && i + 1 < argc) {
+                std::string value = argv[++i];
+                options.block_size = value == "auto" ? 0 : parse_block_size(value);
+                if (value != "auto" && (options.block_size == 0 || options.block_size > MAX_CHUNK_SIZE)) {
+                    std::cerr << "Block size must be between 1 byte and " << MAX_CHUNK_SIZE / (1024 * 1024) << "M, or auto.\n";
+                    return false;
+                }
+            } else {
+                std::cerr << "Unknown or incomplete option: " << arg << '\n';
+                return false;
+            }
+        } catch (const std::exception &) {
+            std::cerr << "Invalid value for option: " << arg << '\n';
+            return false;
+        }
+    }
+
+    if (options.min_level < 0 || options.max_level > 9 || options.min_level > options.max_level) {
+        std::cerr << "Compression levels must satisfy 0 <= min-level <= max-level <= 9.\n";
+        return false;
+    }
+    if (options.target_throughput < 0) {
+        std::cerr << "Target throughput must not be negative.\n";
+        return false;
+    }
+
+    return true;
+}
+
 int main(int argc, char *argv[]) {
     MPI_Init(&argc, &argv);
 
@@ -86,12 +158,25 @@ int main(int argc, char *argv[]) {
 
     // Check for correct usage
     if (argc < 4) {
-        std::cerr << "Usage: " << argv[0] << " <compress/decompress> <source directory path> <output directory path>\n";
+        std::cerr << "Usage: " << argv[0] << " <compress/decompress> <source directory path> <output directory path>"
+                  << " [--auto-level] [--target-throughput <MB/s>] [--min-level <0-9>] [--max-level <0-9>]"
+                  << " [--block-size <bytes[K|M]|auto>]\n";
         MPI_Abort(MPI_COMM_WORLD, 1);
         return 1;
     }
 
+    CompressionOptions options;
     std::string operation = argv[1];
+    if (operation != "compress" && argc > 4) {
+        std::cerr << "Options after the output directory are only supported for compress.\n";
+        MPI_Abort(MPI_COMM_WORLD, 1);
+        return 1;
+    }
+    if (!parse_compression_options(argc, argv, options)) {
+        MPI_Abort(MPI_COMM_WORLD, 1);
+        return 1;
+    }
+
     std::string source_path = argv[2];
     std::string output_path = argv[3];
 
@@ -132,7 +217,7 @@ int main(int argc, char *argv[]) {
 
     // Execute the specified operation
     if (operation == "compress") {
-        compress(source_path, output_path);
+        compress(source_path, output_path, options);
     } else if (operation == "decompress") {
         decompress(source_path, output_path);
     } else {
@@ -1,18 +1,48 @@
 #ifndef FINAL_DEMO_PROCESS_HPP
 #define FINAL_DEMO_PROCESS_HPP
 
-#include <array>
+#include <cstdint>
 #include <filesystem>
 #include <iostream>
+#include <memory>
 #include <mpi.h>
 #include <omp.h>
+#include <string_view>
+#include <vector>
 #include <zlib.h>
 #include <openssl/md5.h>
 
-constexpr std::size_t CHUNK_SIZE = 65535;
+constexpr std::size_t LEGACY_CHUNK_SIZE = 65535;           // Block size of archives written without a header
+constexpr std::size_t MAX_CHUNK_SIZE = 64 * 1024 * 1024;   // Upper bound for user supplied block sizes
+constexpr char ARCHIVE_MAGIC[4] = {'Z', 'W', 'Z', '\x02'};
 #define NUM_CONSUMERS 1
 #define MD5_DATA_SIZE 32
 
+// Runtime options for compression, parsed from the command line
+struct CompressionOptions {
+    bool auto_level = false;       // Adjust the deflate level per chunk at runtime
+    double target_throughput = 0;  // Job-wide target in MB/s, 0 means no target
+    int min_level = 1;
+    int max_level = 9;
+    std::size_t block_size = 0;    // Fixed block size in bytes, 0 means pick per file from its size
+};
+
+// At the start of every .zwz file, followed by the chunk records
+struct ArchiveHeader {
+    char magic[4];
+    std::uint32_t max_block_size;  // Largest uncompressed block in the archive, patched in after the last record
+};
+
+// Where this rank runs inside its node
+struct NodeTopology {
+    int local_rank = 0;     // Rank among the ranks sharing the node
+    int local_size = 1;     // Number of ranks sharing the node
+    int numa_node = 0;           // NUMA node of the first CPU in cpus
+    int thread_count = 1;        // Worker threads the rank should start
+    std::vector<int> cpus;       // CPUs this rank's threads may run on, empty when threads are not pinned
+    std::vector<int> cpu_nodes;  // NUMA node of each entry in cpus
+};
+
 struct FileEntry {
     std::string relpath;// Relative path
     off_t size;
@@ -21,24 +51,33 @@ struct FileEntry {
 struct Chunk {
     int sequence_id;
     std::string relative_path;
-    std::array<unsigned char, CHUNK_SIZE> data;
+    std::unique_ptr<unsigned char[]> data;  // Allocated without zero-filling, the first size bytes are valid
     size_t size;
     bool is_last_chunk;
     bool is_last_file;
 };
 
+// Location of one chunk record inside a memory mapped archive
 struct CompressedChunk {
-    std::string relative_path;
+    std::string_view relative_path;
     int sequence_id;
     bool is_last_chunk;
-    std::array<unsigned char, CHUNK_SIZE> data;
+    std::size_t data_offset;   // Compressed payload, relative to the start of the mapping
+    std::size_t data_size;
+    std::size_t md5_offset;    // MD5 after the payload of the last chunk, 0 for other chunks
 };
 
 std::string sort_files_by_size(const std::filesystem::path &path);
 int count_non_empty_lines(const std::string &file_path);
-void do_compression(const std::string &input_dir, const std::string &output_dir, const std::string &file_record, int world_rank);
-void do_decompression(const std::string &input_dir, const std::string &output_dir);
+void do_compression(const std::string &input_dir, const std::string &output_dir, const std::string &file_record, int world_rank,
+                    const CompressionOptions &options, const NodeTopology &topology);
+void do_decompression(const std::string &input_dir, const std::string &output_dir, const NodeTopology &topology);
+std::string md5_hex(MD5_CTX &md5Context);
 std::string md5_of_file(const std::string &file_path);
 bool is_md5_match(const std::string &file_path, const std::string &expected_md5);
+NodeTopology detect_topology(MPI_Comm comm);
+int topology_thread_count(const NodeTopology &topology);
+void bind_thread_to_topology(const NodeTopology &topology, int thread_index);
+std::string describe_topology(const NodeTopology &topology);
 
 #endif
@@ -0,0 +1,177 @@
+#include "process.hpp"
+#include <algorithm>
+#include <cctype>
+#include <filesystem>
+#include <fstream>
+#include <iostream>
+#include <map>
+#include <mpi.h>
+#include <omp.h>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#ifdef __linux__
+#include <sched.h>
+#endif
+
+// Map every CPU to its NUMA node from sysfs, CPUs of machines without NUMA information stay on node 0
+std::map<int, int> read_cpu_nodes() {
+    std::map<int, int> cpu_nodes;
+    const std::filesystem::path node_root = "/sys/devices/system/node";
+
+    std::error_code ec;
+    for (const auto &entry : std::filesystem::directory_iterator(node_root, ec)) {
+        std::string name = entry.path().filename().string();
+        if (name.rfind("node", 0) != 0 || name.size() == 4 || !std::isdigit(static_cast<unsigned char>(name[4]))) {
+            continue;
+        }
+        int node = std::stoi(name.substr(4));
+
+        // cpulist looks like "0-7,16-23"
+        std::ifstream cpulist(entry.path() / "cpulist");
+        std::string range;
+        while (std::getline(cpulist, range, ',')) {
+            if (range.empty() || !std::isdigit(static_cast<unsigned char>(range[0]))) {
+                continue;
+            }
+            std::size_t dash = range.find('-');
+            int first = std::stoi(range.substr(0, dash));
+            int last = dash == std::string::npos ? first : std::stoi(range.substr(dash + 1));
+            for (int cpu = first; cpu <= last; ++cpu) {
+                cpu_nodes[cpu] = node;
+            }
+        }
+    }
+
+    return cpu_nodes;
+}
+
+NodeTopology detect_topology(MPI_Comm comm) {
+    NodeTopology topology;
+
+    // Ranks of comm that share this node's memory
+    MPI_Comm node_comm;
+    MPI_Comm_split_type(comm, MPI_COMM_TYPE_SHARED, 0, MPI_INFO_NULL, &node_comm);
+    MPI_Comm_rank(node_comm, &topology.local_rank);
+    MPI_Comm_size(node_comm, &topology.local_size);
+
+#ifdef __linux__
+    cpu_set_t mask;
+    CPU_ZERO(&mask);
+    sched_getaffinity(0, sizeof(mask), &mask);
+
+    // Ranks with the same affinity mask, e.g. all ranks of a socket when the launcher binds to sockets or every rank
+    // when it does not bind at all, form a group and split the group's CPUs between them
+    std::vector<cpu_set_t> masks(topology.local_size);
+    MPI_Allgather(&mask, sizeof(mask), MPI_BYTE, masks.data(), sizeof(mask), MPI_BYTE, node_comm);
+    int group_rank = 0;
+    int group_size = 0;
+    for (int i = 0; i < topology.local_size; ++i) {
+        if (CPU_EQUAL(&masks[i], &mask)) {
+            group_rank += i < topology.local_rank;
+            ++group_size;
+        }
+    }
+
+    // Allowed CPUs grouped by NUMA node
+    std::map<int, int> cpu_nodes = read_cpu_nodes();
+    std::map<int, std::vector<int>> node_cpus;
+    for (int cpu = 0; cpu < CPU_SETSIZE; ++cpu) {
+        if (CPU_ISSET(cpu, &mask)) {
+            auto found = cpu_nodes.find(cpu);
+            node_cpus[found == cpu_nodes.end() ? 0 : found->second].push_back(cpu);
+        }
+    }
+    std::vector<std::pair<int, std::vector<int>>> nodes(node_cpus.begin(), node_cpus.end());
+    int node_count = static_cast<int>(nodes.size());
+
+    auto take = [&](int node, std::size_t begin, std::size_t end) {
+        for (std::size_t i = begin; i < end; ++i) {
+            topology.cpus.push_back(nodes[node].second[i]);
+            topology.cpu_nodes.push_back(nodes[node].first);
+        }
+    };
+
+    if (group_size <= node_count) {
+        // Few ranks, each one takes whole NUMA nodes
+        int first = node_count * group_rank / group_size;
+        int last = node_count * (group_rank + 1) / group_size;
+        for (int node = first; node < last; ++node) {
+            take(node, 0, nodes[node].second.size());
+        }
+    } else {
+        // Many ranks, spread them over the nodes and split each node between the ranks placed on it, so that no
+        // rank spans two nodes
+        int node = group_rank * node_count / group_size;
+        int first_rank = 0;
+        int ranks_on_node = 0;
+        for (int rank = group_size - 1; rank >= 0; --rank) {
+            if (rank * node_count / group_size == node) {
+                first_rank = rank;
+                ++ranks_on_node;
+            }
+        }
+
+        std::size_t node_size = nodes[node].second.size();
+        std::size_t index = group_rank - first_rank;
+        if (node_size >= static_cast<std::size_t>(ranks_on_node)) {
+            take(node, node_size * index / ranks_on_node, node_size * (index + 1) / ranks_on_node);
+        } else {
+            // More ranks than CPUs on the node, ranks have to share
+            take(node, index % node_size, index % node_size + 1);
+        }
+    }
+
+    topology.numa_node = topology.cpu_nodes.empty() ? 0 : topology.cpu_nodes.front();
+    topology.thread_count = std::max<int>(1, static_cast<int>(topology.cpus.size()));
+#else
+    // No affinity API, only divide the processor count between the ranks
+    topology.thread_count = std::max(1, omp_get_num_procs() / topology.local_size);
+#endif
+
+    MPI_Comm_free(&node_comm);
+    return topology;
+}
+
+int topology_thread_count(const NodeTopology &topology) {
+    return topology.thread_count;
+}
+
+void bind_thread_to_topology(const NodeTopology &topology, int thread_index) {
+#ifdef __linux__
+    if (topology.cpus.empty()) {
+        return;
+    }
+
+    // Bind to the rank's CPUs on one NUMA node only. Memory is placed on first touch, so buffers this thread
+    // allocates afterwards end up on that node.
+    int node = topology.cpu_nodes[thread_index % topology.cpus.size()];
+    cpu_set_t mask;
+    CPU_ZERO(&mask);
+    for (std::size_t i = 0; i < topology.cpus.size(); ++i) {
+        if (topology.cpu_nodes[i] == node) {
+            CPU_SET(topology.cpus[i], &mask);
+        }
+    }
+    if (sched_setaffinity(0, sizeof(mask), &mask) != 0) {
+        std::cerr << "Failed to bind thread " << omp_get_thread_num() << " to the rank's CPUs" << std::endl;
+    }
+#else
+    (void) topology;
+    (void) thread_index;
+#endif
+}
+
+std::string describe_topology(const NodeTopology &topology) {
+    std::ostringstream description;
+    description << "local rank " << topology.local_rank << "/" << topology.local_size
+                << ", threads: " << topology.thread_count;
+    if (!topology.cpus.empty()) {
+        description << ", NUMA node " << topology.numa_node << ", CPUs:";
+        for (int cpu : topology.cpus) {
+            description << " " << cpu;
+        }
+    }
+    return description.str();
+}
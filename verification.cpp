@@ -1,8 +1,22 @@
 #include <fstream>
+#include <iomanip>
 #include <iostream>
 #include <openssl/md5.h>
 #include <sstream>
 
+// Finish an MD5 context and format the digest as lowercase hex
+std::string md5_hex(MD5_CTX &md5Context) {
+    unsigned char result[MD5_DIGEST_LENGTH];
+    MD5_Final(result, &md5Context);
+
+    std::stringstream md5StringStream;
+    for (unsigned char i: result) {
+        md5StringStream << std::hex << std::setw(2) << std::setfill('0') << (int) i;
+    }
+
+    return md5StringStream.str();
+}
+
 std::string md5_of_file(const std::string &file_path) {
     std::ifstream file(file_path, std::ifstream::binary);
     if (!file) {
@@ -18,15 +32,7 @@ std::string md5_of_file(const std::string &file_path) {
         MD5_Update(&md5Context, buffer, file.gcount());
     }
 
-    unsigned char result[MD5_DIGEST_LENGTH];
-    MD5_Final(result, &md5Context);
-
-    std::stringstream md5StringStream;
-    for (unsigned char i: result) {
-        md5StringStream << std::hex << std::setw(2) << std::setfill('0') << (int) i;
-    }
-
-    return md5StringStream.str();
+    return md5_hex(md5Context);
 }
 
 bool is_md5_match(const std::string &file_path, const std::string &expected_md5) {